@@ -6,6 +6,9 @@
 #include <Kore/Audio1/Audio.h>
 #include <Kore/Audio2/Audio.h>
 #include "SimpleGraphics.h"
+#include "Level.h"
+#include "Visibility.h"
+#include "Palette.h"
 #include <Kore/Input/Keyboard.h>
 #include <Kore/Log.h>
 #include <cstring>
@@ -15,15 +18,17 @@
 
 using namespace Kore;
 
-// Level definition. A level is made up of LevelWidth * LevelHeight cells that have a size of CellSize. If a cell is filled with a 
-// value of (0, 0, 0), it is empty. Otherwise, it is a wall with the specified color.
-static constexpr unsigned int LevelWidth = 10;
-static constexpr unsigned int LevelHeight = 10;
-
-const float CellSize = 100.0f;
 const float TextureSize = 64.0f;
 
-int Level[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+const int InitialLevel[] = {1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 0, 0, 0, 0, 33, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1};
+
+// The level as seen by the current frame, taken once in UpdateView so that edits never show up halfway through a frame
+const int* ViewLevel;
+
+// Doors close the gap in the middle wall and can be toggled at runtime
+const Kore::vec2i Doors[] = { Kore::vec2i(5, 4), Kore::vec2i(5, 5) };
+const int DoorIndex = 33;
+bool DoorsOpen = true;
 
 Kore::vec2 CurrentPosition = Kore::vec2(
 	LevelWidth * CellSize * 0.2f,
@@ -47,10 +52,24 @@ const float WalkingSpeed = 100.0f;
 
 const float DistanceFactor = 25.0f * 512.0f;
 
+// Solve neighbouring columns against the wall face hit by the previous column instead of traversing the grid again
+bool UseBeamCoherence = true;
+
 constexpr int NumTextures = 1;
 Kore::Graphics4::Texture* Walls;
 Kore::vec3* Colors;
 
+// Render into an 8-bit palettized framebuffer, using the wall atlas quantized at load and the colormap for shadows.
+// Has to be set before the first frame.
+bool UseIndexedColor = false;
+const int ShadowLightLevel = NumLightLevels / 2;
+int Palette[PaletteSize];
+unsigned char* Colormap;
+IndexedTexture IndexedWalls;
+
+// Draw the vertical wall slices into a column-major scratch buffer that is transposed into the display texture once per frame
+bool UseTransposedFramebuffer = true;
+
 namespace {
 	double startTime;
 	
@@ -97,7 +116,7 @@ namespace {
 		{
 			return 0;
 		}
-		return Level[index];
+		return ViewLevel[index];
 	}
 
 	Kore::vec3 GetColor(const Kore::vec2i& Cell)
@@ -344,9 +363,77 @@ namespace {
 		return Distance;
 	}
 
+	/** Solves a ray analytically against the wall face that was hit by the ray of the previous column */
+	// Expects the results of the previous ray in HitCell, HitPoint and HitNormal and only updates them on success. The hit index
+	// stays the same, since the face belongs to the same cell.
+	// Both rays start at Position, so if no grid corner lies between them they pass through exactly the same cells and the new
+	// ray is just as unobstructed as the previous one. Returns false if the ray leaves the face or a corner is found, in which
+	// case the caller needs to fall back to CastRay.
+	bool CastRayCoherent(Kore::vec2 Position, float Angle, float& Distance, Kore::vec2i& HitCell, Kore::vec2& HitPoint, int& TexCoordX, Kore::vec2& HitNormal)
+	{
+		Kore::vec2 Direction = GetForwardVector(Angle);
+
+		// The normal points along the previous ray, so it tells us on which grid line the face lies and from which side it was hit
+		int FaceAxis = HitNormal.x() != 0.0f ? 0 : 1;
+		int OtherAxis = 1 - FaceAxis;
+		float NormalSign = HitNormal[FaceAxis];
+		if (Direction[FaceAxis] * NormalSign <= 0.0f)
+		{
+			return false;
+		}
+		float FaceCoord = (HitCell[FaceAxis] + (NormalSign > 0.0f ? 0 : 1)) * CellSize;
+		float T = (FaceCoord - Position[FaceAxis]) / Direction[FaceAxis];
+		Kore::vec2 NewHitPoint = Position + Direction * T;
+		if ((int)Kore::floor(NewHitPoint[OtherAxis] / CellSize) != HitCell[OtherAxis])
+		{
+			return false;
+		}
+
+		// Look for grid corners in the triangle between both rays and the face. Every corner lies on a grid line of either axis,
+		// so it is enough to check the lines of the axis that the rays cross fewer of.
+		Kore::vec2 PreviousDelta = HitPoint - Position;
+		Kore::vec2 NewDelta = NewHitPoint - Position;
+		int Axis = Kore::abs(NewDelta.x()) < Kore::abs(NewDelta.y()) ? 0 : 1;
+		int Other = 1 - Axis;
+		if (Kore::abs(NewDelta[Axis]) > 0.0f && Kore::abs(PreviousDelta[Axis]) > 0.0f)
+		{
+			float PreviousSlope = PreviousDelta[Other] / PreviousDelta[Axis];
+			float NewSlope = NewDelta[Other] / NewDelta[Axis];
+			int Step = NewDelta[Axis] > 0.0f ? 1 : -1;
+			int Line = (int)Kore::floor(Position[Axis] / CellSize) + (Step > 0 ? 1 : 0);
+			for (; (Line * CellSize - NewHitPoint[Axis]) * Step < 0.0f; Line += Step)
+			{
+				float Offset = Line * CellSize - Position[Axis];
+				float PreviousCoord = Position[Other] + Offset * PreviousSlope;
+				float NewCoord = Position[Other] + Offset * NewSlope;
+				if ((int)Kore::floor(PreviousCoord / CellSize) != (int)Kore::floor(NewCoord / CellSize))
+				{
+					return false;
+				}
+			}
+		}
+
+		// Same conventions as in CastRay
+		Distance = Kore::abs(Kore::cos(CurrentAngle) * NewDelta.x() - Kore::sin(CurrentAngle) * NewDelta.y());
+		float HitPosition = fmod(NewHitPoint[OtherAxis], CellSize) / CellSize;
+		TexCoordX = (int)(HitPosition * TextureSize);
+		HitPoint = NewHitPoint;
+		return true;
+	}
+
 
 	void DrawVerticalLine(const Kore::vec3& Color, int X, int LineHeight)
 	{
+		if (UseIndexedColor)
+		{
+			int PackedColor = 0xff << 24 | (int)(Color.x() * 255) << 16 | (int)(Color.y() * 255) << 8 | (int)(Color.z() * 255);
+			unsigned char ColorIndex = (unsigned char)findClosestColor(Palette, PackedColor);
+			for (int y = 0; y < LineHeight; y++)
+			{
+				setPixelIndexed(X, ((height - LineHeight) / 2) + y, ColorIndex);
+			}
+			return;
+		}
 		for (int y = 0; y < LineHeight; y++)
 		{
 			setPixel(X, ((height - LineHeight) / 2) + y, Color.x(), Color.y(), Color.z());
@@ -374,6 +461,23 @@ namespace {
 		}
 	}
 
+
+	void DrawVerticalLine(const IndexedTexture& InTexture, int Index, int LightLevel, int X, int texX, int LineHeight)
+	{
+		int NumTexturesHorizontal = (int)(InTexture.width / TextureSize);
+		int TexIndexX = Index % NumTexturesHorizontal;
+		int TexIndexY = Index / NumTexturesHorizontal;
+		int OffsetX = TexIndexX * (int) TextureSize;
+		int OffsetY = TexIndexY * (int) TextureSize;
+		const unsigned char* Column = &InTexture.pixels[OffsetY * InTexture.width + OffsetX + texX];
+		const unsigned char* Shade = &Colormap[LightLevel * PaletteSize];
+		for (int y = 0; y < LineHeight; y++)
+		{
+			int texY = y * (int)TextureSize / LineHeight;
+			setPixelIndexed(X, ((height - LineHeight) / 2) + y, Shade[Column[texY * InTexture.width]]);
+		}
+	}
+
 	//@@TODO: Implement DeltaT
 	void UpdateView(float DeltaT)
 	{
@@ -399,39 +503,70 @@ namespace {
 		}
 
 		// Draw graphics
+		ViewLevel = levelSnapshot();
 		float HalfFOV = Kore::pi * 0.25f;
 		float StartAngle = CurrentAngle + HalfFOV;
 		float DeltaAngle = -HalfFOV * 2.0f / (float)width;
 		float CurrentRayAngle = StartAngle;
-		int CurrentIndex;
+		int CurrentIndex = -1;
 		Kore::vec2i HitCell;
 		Kore::vec2 HitPoint;
 		Kore::vec2 HitNormal;
 		int TexCoordX = 0;
+
+		// Only wall faces in front of cells that can see the light need a shadow ray. If none of them are visible from the
+		// camera, the light can be skipped for the whole frame.
+		Kore::vec2i CameraCell = GetCell(CurrentPosition);
+		Kore::vec2i LightCell = GetCell(LightSource);
+		VisibleSet CameraVisibility;
+		VisibleSet LightVisibility;
+		getVisibleSet(CameraCell.x(), CameraCell.y(), CameraVisibility);
+		getVisibleSet(LightCell.x(), LightCell.y(), LightVisibility);
+		bool IsLightCulled = !CameraVisibility.intersects(LightVisibility);
+
 		for (int X = 0; X < width; X++)
 		{
-			float Distance = CastRay(CurrentPosition, CurrentRayAngle, CurrentIndex, HitCell, HitPoint, TexCoordX, HitNormal);
+			float Distance;
+			bool IsCoherent = UseBeamCoherence && IsSolid(CurrentIndex) && CastRayCoherent(CurrentPosition, CurrentRayAngle, Distance, HitCell, HitPoint, TexCoordX, HitNormal);
+			if (!IsCoherent)
+			{
+				Distance = CastRay(CurrentPosition, CurrentRayAngle, CurrentIndex, HitCell, HitPoint, TexCoordX, HitNormal);
+			}
 			float LineHeight = DistanceFactor / Distance;
 			if (IsSolid(CurrentIndex))
 			{
-				// Cast another ray at the light source to check for shadows
-				Kore::vec2i HitCellLight;
-				Kore::vec2 HitPointLight;
-				Kore::vec2 HitNormalLight;
-				int TexXLight;
-				int LightIndex;
-
-				// Calculate the angle to the light
+				// The hit normal points along the ray, so the open cell in front of the face is the one we came from
+				Kore::vec2i FrontCell = Kore::vec2i(HitCell.x() - (int)HitNormal.x(), HitCell.y() - (int)HitNormal.y());
 				Kore::vec2 ToLightNormal = (LightSource - HitPoint).normalize();
-				float LightAngle = -Kore::atan2(ToLightNormal.y(), ToLightNormal.x()) - Kore::atan2(0.0f, 1.0f) + Kore::pi * 2.0f;
-
-				// float RayDistanceLight = CastRay(HitPoint + ToLightNormal * CellSize * 0.1f, LightAngle, LightIndex, HitCellLight, HitPointLight, TexXLight);
-				float RayDistanceLight = CastRay(HitPoint, LightAngle, LightIndex, HitCellLight, HitPointLight, TexXLight, HitNormalLight);
-				bool IsShadowed = ((HitPointLight - HitPoint).squareLength() < (LightSource - HitPoint).squareLength());
-				IsShadowed |= HitNormal.dot(ToLightNormal) > 0.0f;
+				bool IsShadowed = IsLightCulled || !LightVisibility.test(FrontCell.x(), FrontCell.y()) || HitNormal.dot(ToLightNormal) > 0.0f;
+				if (!IsShadowed)
+				{
+					// Cast another ray at the light source to check for shadows
+					Kore::vec2i HitCellLight;
+					Kore::vec2 HitPointLight;
+					Kore::vec2 HitNormalLight;
+					int TexXLight;
+					int LightIndex;
+
+					// Calculate the angle to the light
+					float LightAngle = -Kore::atan2(ToLightNormal.y(), ToLightNormal.x()) - Kore::atan2(0.0f, 1.0f) + Kore::pi * 2.0f;
+
+					// float RayDistanceLight = CastRay(HitPoint + ToLightNormal * CellSize * 0.1f, LightAngle, LightIndex, HitCellLight, HitPointLight, TexXLight);
+					float RayDistanceLight = CastRay(HitPoint, LightAngle, LightIndex, HitCellLight, HitPointLight, TexXLight, HitNormalLight);
+					IsShadowed = ((HitPointLight - HitPoint).squareLength() < (LightSource - HitPoint).squareLength());
+				}
 
-				int TextureIndex = IsShadowed ? CurrentIndex : CurrentIndex - 1;
-				DrawVerticalLine(Walls, TextureIndex, X, TexCoordX, (int)LineHeight);
+				if (UseIndexedColor)
+				{
+					// The colormap takes care of the shadow, so the lit tile is used either way
+					int LightLevel = IsShadowed ? ShadowLightLevel : NumLightLevels - 1;
+					DrawVerticalLine(IndexedWalls, CurrentIndex - 1, LightLevel, X, TexCoordX, (int)LineHeight);
+				}
+				else
+				{
+					int TextureIndex = IsShadowed ? CurrentIndex : CurrentIndex - 1;
+					DrawVerticalLine(Walls, TextureIndex, X, TexCoordX, (int)LineHeight);
+				}
 			}
 			CurrentRayAngle += DeltaAngle;
 		}
@@ -480,19 +615,43 @@ namespace {
 		lastT = t;
 		Kore::Audio2::update();
 
+		// Publish the edits made since the last frame before anything reads the level
+		commitLevelEdits();
+
 		startFrame();
 
 		/************************************************************************/
 		/* Exercise 2, Practical Task:
 		/* Add some interesting animations or effects here
 		/************************************************************************/
-		clear(0.0f, 0, 0);
+		if (UseIndexedColor)
+		{
+			clearIndexed(0);
+		}
+		else
+		{
+			clear(0.0f, 0, 0);
+		}
 		//drawTexture(image, (int)(sin(t) * 400), (int)(abs(sin(t * 1.5f)) * 470));
 		UpdateView(deltaT);
 
 		endFrame();
 	}
 
+	void ToggleDoors()
+	{
+		DoorsOpen = !DoorsOpen;
+		Kore::vec2i PlayerCell = GetCell(CurrentPosition);
+		for (const Kore::vec2i& Door : Doors)
+		{
+			// Don't close a door on top of the player
+			if (!DoorsOpen && Door.x() == PlayerCell.x() && Door.y() == PlayerCell.y())
+			{
+				continue;
+			}
+			setLevelCell(Door.x(), Door.y(), DoorsOpen ? 0 : DoorIndex);
+		}
+	}
 
 }
 
@@ -514,6 +673,10 @@ void handleInput(KeyCode code, bool Value)
 	{
 		KeyDownDown = Value;
 	}
+	else if (code == KeySpace && Value)
+	{
+		ToggleDoors();
+	}
 }
 
 void keyDown(KeyCode code) {
@@ -544,11 +707,19 @@ int kore(int argc, char** argv) {
 	Kore::System::initWindow(options); */
 
 	initGraphics();
+	setTransposedMode(UseTransposedFramebuffer);
 
 	Keyboard::the()->KeyDown = keyDown;
 	Keyboard::the()->KeyUp = keyUp;
 
 	// SetupMap();
+	initLevel(InitialLevel);
+	ViewLevel = levelSnapshot();
+	for (const Kore::vec2i& Door : Doors)
+	{
+		setLevelCellDynamic(Door.x(), Door.y(), true);
+	}
+	initVisibility("Level.pvs");
 	Kore::System::setCallback(update);
 
 
@@ -558,6 +729,14 @@ int kore(int argc, char** argv) {
 	Walls = loadTexture("Walls.png");
 	Colors = new Kore::vec3[NumTextures + 1];
 	Colors[1] = Kore::vec3(1.0f, 0.0f, 0.0f);
+	if (UseIndexedColor)
+	{
+		quantizeTexture(Walls, Palette, IndexedWalls);
+		Colormap = new unsigned char[NumLightLevels * PaletteSize];
+		buildColormap(Palette, Colormap);
+		setPalette(Palette);
+		setIndexedMode(true);
+	}
 	Kore::Audio1::init();
 	Kore::Audio2::init();
 	Kore::Audio1::play(new SoundStream("back.ogg", true));
@@ -565,6 +744,11 @@ int kore(int argc, char** argv) {
 	Kore::System::start();
 
 	destroyTexture(Walls);
+	if (UseIndexedColor)
+	{
+		destroyIndexedTexture(IndexedWalls);
+		delete[] Colormap;
+	}
 	
 	return 0;
 }
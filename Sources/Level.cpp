@@ -0,0 +1,118 @@
+#include "pch.h"
+#include "Level.h"
+#include <atomic>
+#include <cstring>
+#include <vector>
+
+namespace {
+	const int NumCells = LevelWidth * LevelHeight;
+
+	// The level is double-buffered: readers only ever see the front buffer, edits go to the back buffer
+	int buffers[2][NumCells];
+	std::atomic<int> front(0);
+
+	bool dirty[NumCells];
+	bool dynamicCells[NumCells];
+	std::vector<int> dirtyCells;
+	std::vector<LevelEdit> edits;
+	// Edits of the last commit that still need to be copied to the back buffer, which readers may still be using
+	std::vector<LevelEdit> catchUp;
+	std::vector<LevelListener> listeners;
+}
+
+void initLevel(const int* cells) {
+	memcpy(buffers[0], cells, sizeof(buffers[0]));
+	memcpy(buffers[1], cells, sizeof(buffers[1]));
+	memset(dirty, 0, sizeof(dirty));
+	dirtyCells.clear();
+	catchUp.clear();
+	front.store(0);
+}
+
+const int* levelSnapshot() {
+	return buffers[front.load(std::memory_order_acquire)];
+}
+
+int getLevelCell(const int* snapshot, int x, int y) {
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return 0;
+	}
+	return snapshot[y * LevelWidth + x];
+}
+
+void setLevelCell(int x, int y, int value) {
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return;
+	}
+	int* back = buffers[1 - front.load()];
+
+	// Bring the back buffer up to date with the last commit before editing it, only touching the cells that changed
+	for (const LevelEdit& edit : catchUp) {
+		back[edit.y * LevelWidth + edit.x] = edit.value;
+	}
+	catchUp.clear();
+
+	int index = y * LevelWidth + x;
+	back[index] = value;
+	if (!dirty[index]) {
+		dirty[index] = true;
+		dirtyCells.push_back(index);
+	}
+}
+
+int commitLevelEdits() {
+	if (dirtyCells.empty()) {
+		return 0;
+	}
+
+	int oldFront = front.load();
+	int newFront = 1 - oldFront;
+
+	edits.clear();
+	for (int index : dirtyCells) {
+		dirty[index] = false;
+		int previous = buffers[oldFront][index];
+		int value = buffers[newFront][index];
+		if (previous != value) {
+			LevelEdit edit;
+			edit.x = index % LevelWidth;
+			edit.y = index / LevelWidth;
+			edit.previous = previous;
+			edit.value = value;
+			edits.push_back(edit);
+		}
+	}
+	dirtyCells.clear();
+
+	if (edits.empty()) {
+		return 0;
+	}
+
+	front.store(newFront, std::memory_order_release);
+
+	// The old front becomes the back buffer, but readers may still hold it, so it is only updated with the next edit
+	catchUp = edits;
+
+	for (LevelListener listener : listeners) {
+		listener(edits.data(), (int)edits.size());
+	}
+	return (int)edits.size();
+}
+
+void addLevelListener(LevelListener listener) {
+	listeners.push_back(listener);
+}
+
+void setLevelCellDynamic(int x, int y, bool dynamic) {
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return;
+	}
+	dynamicCells[y * LevelWidth + x] = dynamic;
+}
+
+bool isLevelCellDynamic(int x, int y) {
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return false;
+	}
+	return dynamicCells[y * LevelWidth + x];
+}
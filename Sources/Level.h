@@ -0,0 +1,37 @@
+#pragma once
+
+// Level definition. A level is made up of LevelWidth * LevelHeight cells that have a size of CellSize. A cell with a value of 0
+// is empty, any other value is a wall that is drawn with the corresponding tile of the wall atlas.
+static constexpr unsigned int LevelWidth = 10;
+static constexpr unsigned int LevelHeight = 10;
+
+const float CellSize = 100.0f;
+
+// A single cell change that was published by commitLevelEdits
+struct LevelEdit {
+	int x;
+	int y;
+	int previous;
+	int value;
+};
+
+// Called after each commit with the cells that actually changed, so derived data can be updated incrementally
+typedef void (*LevelListener)(const LevelEdit* edits, int count);
+
+void initLevel(const int* cells);
+
+// Returns the currently published level, so readers can take a snapshot once per frame and use it without any locking.
+// A snapshot stays unchanged until the first setLevelCell after the commit that replaced it, so all readers have to be done
+// with a frame before the next edits for the following frame are made.
+const int* levelSnapshot();
+int getLevelCell(const int* snapshot, int x, int y);
+
+// Edits are staged in the back buffer and only become visible to readers with commitLevelEdits, which should be called between frames
+void setLevelCell(int x, int y, int value);
+int commitLevelEdits();
+void addLevelListener(LevelListener listener);
+
+// Dynamic cells (doors, destructible walls) are expected to change at runtime. Precomputed data such as the visibility sets
+// treats them as open so that toggling them does not invalidate anything.
+void setLevelCellDynamic(int x, int y, bool dynamic);
+bool isLevelCellDynamic(int x, int y);
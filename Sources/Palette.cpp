@@ -0,0 +1,171 @@
+#include "pch.h"
+#include "Palette.h"
+#include "SimpleGraphics.h"
+#include <Kore/Graphics4/Texture.h>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace {
+	// Colors are counted in a 5 bits per channel histogram
+	const int NumBuckets = 32 * 32 * 32;
+
+	int bucketOf(int color) {
+		int r = (color >> 19) & 0x1f;
+		int g = (color >> 11) & 0x1f;
+		int b = (color >> 3) & 0x1f;
+		return r << 10 | g << 5 | b;
+	}
+
+	int colorDistance(int a, int b) {
+		int dr = ((a >> 16) & 0xff) - ((b >> 16) & 0xff);
+		int dg = ((a >> 8) & 0xff) - ((b >> 8) & 0xff);
+		int db = (a & 0xff) - (b & 0xff);
+		return dr * dr + dg * dg + db * db;
+	}
+
+	int blendOverBlack(int color) {
+		int a = (color >> 24) & 0xff;
+		int r = ((color >> 16) & 0xff) * a / 255;
+		int g = ((color >> 8) & 0xff) * a / 255;
+		int b = (color & 0xff) * a / 255;
+		return 0xff << 24 | r << 16 | g << 8 | b;
+	}
+}
+
+int findClosestColor(const int* palette, int color) {
+	int best = 0;
+	int bestDistance = colorDistance(palette[0], color);
+	for (int i = 1; i < PaletteSize && bestDistance > 0; ++i) {
+		int distance = colorDistance(palette[i], color);
+		if (distance < bestDistance) {
+			best = i;
+			bestDistance = distance;
+		}
+	}
+	return best;
+}
+
+void quantizeTexture(Kore::Graphics4::Texture* texture, int* palette, IndexedTexture& result) {
+	int w = texture->texWidth;
+	int h = texture->texHeight;
+
+	std::vector<int> counts(NumBuckets, 0);
+	std::vector<int> sums(NumBuckets * 3, 0);
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int color = blendOverBlack(readPixel(texture, x, y));
+			int bucket = bucketOf(color);
+			counts[bucket]++;
+			sums[bucket * 3 + 0] += (color >> 16) & 0xff;
+			sums[bucket * 3 + 1] += (color >> 8) & 0xff;
+			sums[bucket * 3 + 2] += color & 0xff;
+		}
+	}
+
+	// Median cut: start with one box holding all used buckets and keep splitting the box with the widest color range
+	// at its median until there are enough boxes. Each box then becomes a palette entry with its average color.
+	std::vector<int> buckets;
+	for (int i = 0; i < NumBuckets; ++i) {
+		if (counts[i] > 0) buckets.push_back(i);
+	}
+
+	struct Box {
+		int begin;
+		int end;
+	};
+	std::vector<Box> boxes;
+	boxes.push_back({ 0, (int)buckets.size() });
+	while ((int)boxes.size() < PaletteSize - 1) {
+		int widest = -1;
+		int widestAxis = 0;
+		int widestRange = 0;
+		for (int i = 0; i < (int)boxes.size(); ++i) {
+			if (boxes[i].end - boxes[i].begin < 2) continue;
+			for (int axis = 0; axis < 3; ++axis) {
+				int shift = 10 - axis * 5;
+				int low = 31;
+				int high = 0;
+				for (int j = boxes[i].begin; j < boxes[i].end; ++j) {
+					int value = (buckets[j] >> shift) & 0x1f;
+					low = std::min(low, value);
+					high = std::max(high, value);
+				}
+				if (high - low > widestRange) {
+					widest = i;
+					widestAxis = axis;
+					widestRange = high - low;
+				}
+			}
+		}
+		if (widest < 0) break;
+
+		Box& box = boxes[widest];
+		int shift = 10 - widestAxis * 5;
+		std::sort(buckets.begin() + box.begin, buckets.begin() + box.end, [&](int a, int b) { return ((a >> shift) & 0x1f) < ((b >> shift) & 0x1f); });
+		int total = 0;
+		for (int j = box.begin; j < box.end; ++j) total += counts[buckets[j]];
+		int median = box.begin + 1;
+		for (int sum = counts[buckets[box.begin]]; median < box.end - 1 && sum * 2 < total; ++median) {
+			sum += counts[buckets[median]];
+		}
+		Box upper = { median, box.end };
+		box.end = median;
+		boxes.push_back(upper);
+	}
+
+	palette[0] = 0xff000000;
+	int numColors = 1;
+	for (const Box& box : boxes) {
+		int count = 0;
+		int r = 0;
+		int g = 0;
+		int b = 0;
+		for (int j = box.begin; j < box.end; ++j) {
+			count += counts[buckets[j]];
+			r += sums[buckets[j] * 3 + 0];
+			g += sums[buckets[j] * 3 + 1];
+			b += sums[buckets[j] * 3 + 2];
+		}
+		if (count > 0) {
+			palette[numColors++] = 0xff << 24 | (r / count) << 16 | (g / count) << 8 | (b / count);
+		}
+	}
+	for (int i = numColors; i < PaletteSize; ++i) {
+		palette[i] = palette[0];
+	}
+
+	// Texels of the same bucket map to the same entry, so each bucket only needs to be searched once
+	std::vector<int> mapping(NumBuckets, -1);
+	result.width = w;
+	result.height = h;
+	result.pixels = new unsigned char[w * h];
+	for (int y = 0; y < h; ++y) {
+		for (int x = 0; x < w; ++x) {
+			int color = blendOverBlack(readPixel(texture, x, y));
+			int bucket = bucketOf(color);
+			if (mapping[bucket] < 0) {
+				mapping[bucket] = findClosestColor(palette, color);
+			}
+			result.pixels[y * w + x] = (unsigned char)mapping[bucket];
+		}
+	}
+}
+
+void destroyIndexedTexture(IndexedTexture& texture) {
+	delete[] texture.pixels;
+	texture.pixels = nullptr;
+}
+
+void buildColormap(const int* palette, unsigned char* colormap) {
+	for (int level = 0; level < NumLightLevels; ++level) {
+		int scale = level * 256 / (NumLightLevels - 1);
+		for (int i = 0; i < PaletteSize; ++i) {
+			int color = palette[i];
+			int r = std::min(((color >> 16) & 0xff) * scale >> 8, 255);
+			int g = std::min(((color >> 8) & 0xff) * scale >> 8, 255);
+			int b = std::min((color & 0xff) * scale >> 8, 255);
+			colormap[level * PaletteSize + i] = (unsigned char)findClosestColor(palette, 0xff << 24 | r << 16 | g << 8 | b);
+		}
+	}
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+namespace Kore {
+	namespace Graphics4 {
+		class Texture;
+	}
+}
+
+// Palettes have 256 colors in the format returned by readPixel. Entry 0 is always black.
+static constexpr int PaletteSize = 256;
+
+// The colormap has one row of PaletteSize entries per light level, the last level being full brightness
+static constexpr int NumLightLevels = 32;
+
+struct IndexedTexture {
+	int width;
+	int height;
+	unsigned char* pixels;
+};
+
+// Builds a palette for the colors of the texture with median cut and maps every texel to its closest palette entry.
+// Transparent texels are blended over black, as they would be drawn over the cleared framebuffer.
+void quantizeTexture(Kore::Graphics4::Texture* texture, int* palette, IndexedTexture& result);
+void destroyIndexedTexture(IndexedTexture& texture);
+
+int findClosestColor(const int* palette, int color);
+
+// colormap[level * PaletteSize + index] is the palette entry closest to color index darkened to the given light level
+void buildColormap(const int* palette, unsigned char* colormap);
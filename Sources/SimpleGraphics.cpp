@@ -5,7 +5,23 @@
 #include <Kore/Graphics4/Shader.h>
 #include <Kore/Graphics4/PipelineState.h>
 #include <Kore/IO/FileReader.h>
+#include <cstring>
 #include <limits>
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+// AVX2 is not enabled for the whole project, so on x64 the AVX2 code is compiled for that function only and picked at runtime
+#if defined(_M_X64) || defined(__x86_64__)
+#define USE_AVX2
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define AVX2_FUNCTION
+#else
+#define AVX2_FUNCTION __attribute__((target("avx2")))
+#endif
+#endif
 
 using namespace Kore;
 
@@ -18,6 +34,24 @@ namespace {
 	Graphics4::IndexBuffer* ib;
 	Graphics4::Texture* texture;
 	int* image;
+
+	bool indexedMode = false;
+	unsigned char* indexedImage;
+	// Palette colors in the layout of the display texture
+	int palette[256];
+
+	// Transposed scratch buffers, one column after the other. The strides are padded by a cache line so that columns start on
+	// their own cache line and neighbouring columns don't alias to the same cache sets.
+	const int ColumnStride = height + 16;
+	const int IndexedColumnStride = height + 64;
+	bool transposedMode = false;
+	int* columns;
+	unsigned char* indexedColumns;
+
+	template<class T> T* allocateAligned(int count) {
+		u8* memory = new u8[count * sizeof(T) + 64];
+		return (T*)(memory + (64 - (size_t)memory % 64));
+	}
 }
 
 void startFrame() {
@@ -35,6 +69,13 @@ void startFrame() {
 
 void clear(float red, float green, float blue) {
 	CONVERT_COLORS(red, green, blue);
+	if (transposedMode) {
+		int color = 0xff << 24 | b << 16 | g << 8 | r;
+		for (int i = 0; i < width * ColumnStride; ++i) {
+			columns[i] = color;
+		}
+		return;
+	}
 	for (int y = 0; y < height; ++y) {
 		for (int x = 0; x < width; ++x) {
 			image[y * texture->width + x] = 0xff << 24 | b << 16 | g << 8 | r;
@@ -44,11 +85,21 @@ void clear(float red, float green, float blue) {
 
 
 void setPixel(int x, int y, float red, float green, float blue, float alpha /* = 1.0f */) {
-	if (y < 0 || y >= texture->texHeight || x < 0 || x >= texture->texWidth) {
-		return;
+	int* pixel;
+	if (transposedMode) {
+		if (y < 0 || y >= height || x < 0 || x >= width) {
+			return;
+		}
+		pixel = &columns[x * ColumnStride + y];
+	}
+	else {
+		if (y < 0 || y >= texture->texHeight || x < 0 || x >= texture->texWidth) {
+			return;
+		}
+		pixel = &image[y * texture->texWidth + x];
 	}
 	
-	int col = image[y * texture->texWidth + x];
+	int col = *pixel;
 
 // #ifdef OPENGL
 	float bi = ((col >> 16) & 0xff) / 255.0f;
@@ -69,7 +120,7 @@ void setPixel(int x, int y, float red, float green, float blue, float alpha /* =
 	int b = (int)(ab * 255);
 
 //#ifdef OPENGL
-	image[y * texture->texWidth + x] = 0xff << 24 | b << 16 | g << 8 | r;
+	*pixel = 0xff << 24 | b << 16 | g << 8 | r;
 //#else
 	//image[y * texture->texWidth + x] = 0xff << 24 | r << 16 | g << 8 | b;
 //#endif
@@ -112,7 +163,206 @@ int readPixel(Kore::Graphics4::Texture* image, int x, int y) {
 	return a << 24 | r << 16 | g << 8 | b;
 }
 
+void setIndexedMode(bool enabled) {
+	indexedMode = enabled;
+}
+
+bool isIndexedMode() {
+	return indexedMode;
+}
+
+void setPalette(const int* colors) {
+	for (int i = 0; i < 256; ++i) {
+		int r = (colors[i] >> 16) & 0xff;
+		int g = (colors[i] >> 8) & 0xff;
+		int b = colors[i] & 0xff;
+		palette[i] = 0xff << 24 | b << 16 | g << 8 | r;
+	}
+}
+
+void clearIndexed(unsigned char index) {
+	if (transposedMode) {
+		memset(indexedColumns, index, width * IndexedColumnStride);
+	}
+	else {
+		memset(indexedImage, index, width * height);
+	}
+}
+
+void setPixelIndexed(int x, int y, unsigned char index) {
+	if (y < 0 || y >= height || x < 0 || x >= width) {
+		return;
+	}
+	if (transposedMode) {
+		indexedColumns[x * IndexedColumnStride + y] = index;
+	}
+	else {
+		indexedImage[y * width + x] = index;
+	}
+}
+
+void setTransposedMode(bool enabled) {
+	transposedMode = enabled;
+}
+
+bool isTransposedMode() {
+	return transposedMode;
+}
+
+namespace {
+	void expandRow(const unsigned char* in, int* out, int count) {
+		int x = 0;
+		for (; x + 4 <= count; x += 4) {
+			out[x + 0] = palette[in[x + 0]];
+			out[x + 1] = palette[in[x + 1]];
+			out[x + 2] = palette[in[x + 2]];
+			out[x + 3] = palette[in[x + 3]];
+		}
+		for (; x < count; ++x) {
+			out[x] = palette[in[x]];
+		}
+	}
+
+#ifdef USE_AVX2
+	AVX2_FUNCTION void expandRowAvx2(const unsigned char* in, int* out, int count) {
+		int x = 0;
+		for (; x + 8 <= count; x += 8) {
+			__m256i indices = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)&in[x]));
+			_mm256_storeu_si256((__m256i*)&out[x], _mm256_i32gather_epi32(palette, indices, 4));
+		}
+		for (; x < count; ++x) {
+			out[x] = palette[in[x]];
+		}
+	}
+
+	bool hasAvx2() {
+#ifdef _MSC_VER
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7) {
+			return false;
+		}
+		// The OS also has to save the AVX registers
+		__cpuid(info, 1);
+		if ((info[2] & (1 << 27)) == 0 || (info[2] & (1 << 28)) == 0 || (_xgetbv(0) & 6) != 6) {
+			return false;
+		}
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#else
+		return __builtin_cpu_supports("avx2");
+#endif
+	}
+#endif
+
+	void (*expandRowFunction)(const unsigned char* in, int* out, int count) = expandRow;
+
+	// The transposes work on blocks that fit into the L1 cache for both the source columns and the destination rows
+	const int TransposeBlockSize = 16;
+
+	void transposeBlock(int x0, int y0, int w, int h) {
+		int stride = texture->texWidth;
+#ifdef USE_SSE2
+		if (w == TransposeBlockSize && h == TransposeBlockSize) {
+			// 4x4 transposes in registers: four column pieces in, four row pieces out
+			for (int x = x0; x < x0 + w; x += 4) {
+				for (int y = y0; y < y0 + h; y += 4) {
+					__m128i c0 = _mm_load_si128((const __m128i*)&columns[(x + 0) * ColumnStride + y]);
+					__m128i c1 = _mm_load_si128((const __m128i*)&columns[(x + 1) * ColumnStride + y]);
+					__m128i c2 = _mm_load_si128((const __m128i*)&columns[(x + 2) * ColumnStride + y]);
+					__m128i c3 = _mm_load_si128((const __m128i*)&columns[(x + 3) * ColumnStride + y]);
+					__m128i t0 = _mm_unpacklo_epi32(c0, c1);
+					__m128i t1 = _mm_unpacklo_epi32(c2, c3);
+					__m128i t2 = _mm_unpackhi_epi32(c0, c1);
+					__m128i t3 = _mm_unpackhi_epi32(c2, c3);
+					_mm_storeu_si128((__m128i*)&image[(y + 0) * stride + x], _mm_unpacklo_epi64(t0, t1));
+					_mm_storeu_si128((__m128i*)&image[(y + 1) * stride + x], _mm_unpackhi_epi64(t0, t1));
+					_mm_storeu_si128((__m128i*)&image[(y + 2) * stride + x], _mm_unpacklo_epi64(t2, t3));
+					_mm_storeu_si128((__m128i*)&image[(y + 3) * stride + x], _mm_unpackhi_epi64(t2, t3));
+				}
+			}
+			return;
+		}
+#endif
+		for (int y = y0; y < y0 + h; ++y) {
+			for (int x = x0; x < x0 + w; ++x) {
+				image[y * stride + x] = columns[x * ColumnStride + y];
+			}
+		}
+	}
+
+	void transposeBlit() {
+		for (int y = 0; y < height; y += TransposeBlockSize) {
+			for (int x = 0; x < width; x += TransposeBlockSize) {
+				transposeBlock(x, y, min(TransposeBlockSize, width - x), min(TransposeBlockSize, height - y));
+			}
+		}
+	}
+
+	// Transposes a block of indices into rows of TransposeBlockSize bytes
+	void transposeIndexedBlock(int x0, int y0, int w, int h, unsigned char* rows) {
+#ifdef USE_SSE2
+		if (w == TransposeBlockSize && h == TransposeBlockSize) {
+			// Interleaving the first eight columns with the last eight four times over transposes the 16x16 bytes
+			__m128i c[16];
+			for (int i = 0; i < 16; ++i) {
+				c[i] = _mm_load_si128((const __m128i*)&indexedColumns[(x0 + i) * IndexedColumnStride + y0]);
+			}
+			for (int round = 0; round < 4; ++round) {
+				__m128i t[16];
+				for (int i = 0; i < 8; ++i) {
+					t[i * 2 + 0] = _mm_unpacklo_epi8(c[i], c[i + 8]);
+					t[i * 2 + 1] = _mm_unpackhi_epi8(c[i], c[i + 8]);
+				}
+				for (int i = 0; i < 16; ++i) {
+					c[i] = t[i];
+				}
+			}
+			for (int i = 0; i < 16; ++i) {
+				_mm_storeu_si128((__m128i*)&rows[i * TransposeBlockSize], c[i]);
+			}
+			return;
+		}
+#endif
+		for (int y = 0; y < h; ++y) {
+			for (int x = 0; x < w; ++x) {
+				rows[y * TransposeBlockSize + x] = indexedColumns[(x0 + x) * IndexedColumnStride + y0 + y];
+			}
+		}
+	}
+
+	void expandIndexedTransposed() {
+		int stride = texture->texWidth;
+		unsigned char rows[TransposeBlockSize * TransposeBlockSize];
+		for (int y0 = 0; y0 < height; y0 += TransposeBlockSize) {
+			for (int x0 = 0; x0 < width; x0 += TransposeBlockSize) {
+				int w = min(TransposeBlockSize, width - x0);
+				int h = min(TransposeBlockSize, height - y0);
+				transposeIndexedBlock(x0, y0, w, h, rows);
+				for (int y = 0; y < h; ++y) {
+					expandRowFunction(&rows[y * TransposeBlockSize], &image[(y0 + y) * stride + x0], w);
+				}
+			}
+		}
+	}
+
+	void expandIndexed() {
+		for (int y = 0; y < height; ++y) {
+			expandRowFunction(&indexedImage[y * width], &image[y * texture->texWidth], width);
+		}
+	}
+}
+
 void endFrame() {
+	if (indexedMode && transposedMode) {
+		expandIndexedTransposed();
+	}
+	else if (indexedMode) {
+		expandIndexed();
+	}
+	else if (transposedMode) {
+		transposeBlit();
+	}
 	texture->unlock();
 	
 	Kore::Graphics4::setPipeline(program);
@@ -151,6 +401,18 @@ void initGraphics() {
 	}
 	texture->unlock();
 
+	indexedImage = new unsigned char[width * height];
+	memset(indexedImage, 0, width * height);
+#ifdef USE_AVX2
+	if (hasAvx2()) {
+		expandRowFunction = expandRowAvx2;
+	}
+#endif
+	columns = allocateAligned<int>(width * ColumnStride);
+	memset(columns, 0, width * ColumnStride * sizeof(int));
+	indexedColumns = allocateAligned<unsigned char>(width * IndexedColumnStride);
+	memset(indexedColumns, 0, width * IndexedColumnStride);
+
 	// Correct for the difference between the texture's desired size and the actual power of 2 size
 	float xAspect = (float)texture->width / texture->texWidth;
 	float yAspect = (float)texture->height / texture->texHeight;
@@ -17,6 +17,19 @@ void destroyTexture(Kore::Graphics4::Texture* image);
 void drawTexture(Kore::Graphics4::Texture* image, int x, int y);
 int readPixel(Kore::Graphics4::Texture* image, int x, int y);
 
+// Optional 8-bit indexed framebuffer. While it is enabled, drawing goes through clearIndexed and setPixelIndexed and
+// endFrame expands the frame through the palette into the display texture.
+void setIndexedMode(bool enabled);
+bool isIndexedMode();
+void setPalette(const int* colors);
+void clearIndexed(unsigned char index);
+void setPixelIndexed(int x, int y, unsigned char index);
+
+// Optional column-major framebuffer. While it is enabled, all drawing goes to a transposed scratch buffer in which every column
+// is contiguous and starts on its own cache line, and endFrame transposes it into the display texture.
+void setTransposedMode(bool enabled);
+bool isTransposedMode();
+
 // Watch out for resolutions that are higher than your monitor's resolution and for non-power-of-two sizes
 const int width = 512;
 const int height = 512;
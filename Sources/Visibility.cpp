@@ -0,0 +1,315 @@
+#include "pch.h"
+#include "Visibility.h"
+#include <Kore/Log.h>
+#include <atomic>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+using namespace Kore;
+
+namespace {
+	const int NumCells = LevelWidth * LevelHeight;
+	const unsigned int CacheMagic = 0x31535650; // "PVS1"
+
+	// Sample positions inside of a cell, as a fraction of CellSize. The outer ones are close to the border so that
+	// views through narrow gaps and along walls are found.
+	const float Samples[] = { 0.01f, 0.34f, 0.66f, 0.99f };
+	const int NumSamples = sizeof(Samples) / sizeof(Samples[0]);
+
+	// Compressed sets: runs of zero bytes are stored as a zero followed by the run length
+	std::vector<unsigned char> compressed;
+	unsigned int offsets[NumCells];
+	const char* cachePath;
+
+	bool isOccluder(const int* level, int x, int y) {
+		return getLevelCell(level, x, y) > 0 && !isLevelCellDynamic(x, y);
+	}
+
+	unsigned int hashLevel(const int* level) {
+		// FNV-1a over the occluders, which is all the sets depend on
+		unsigned int hash = 2166136261u;
+		hash = (hash ^ LevelWidth) * 16777619u;
+		hash = (hash ^ LevelHeight) * 16777619u;
+		for (int y = 0; y < (int)LevelHeight; ++y) {
+			for (int x = 0; x < (int)LevelWidth; ++x) {
+				hash = (hash ^ (isOccluder(level, x, y) ? 1u : 0u)) * 16777619u;
+			}
+		}
+		return hash;
+	}
+
+	// Walks the cells on the line from (x0, y0) to (x1, y1) and checks if it reaches the target cell before hitting an occluder
+	bool isLineClear(const int* level, float x0, float y0, float x1, float y1, int targetX, int targetY) {
+		int cellX = (int)std::floor(x0 / CellSize);
+		int cellY = (int)std::floor(y0 / CellSize);
+		float dx = x1 - x0;
+		float dy = y1 - y0;
+		int stepX = dx > 0.0f ? 1 : -1;
+		int stepY = dy > 0.0f ? 1 : -1;
+		float tDeltaX = dx != 0.0f ? CellSize / std::fabs(dx) : 1e30f;
+		float tDeltaY = dy != 0.0f ? CellSize / std::fabs(dy) : 1e30f;
+		float tMaxX = dx != 0.0f ? ((stepX > 0 ? (cellX + 1) * CellSize : cellX * CellSize) - x0) / dx : 1e30f;
+		float tMaxY = dy != 0.0f ? ((stepY > 0 ? (cellY + 1) * CellSize : cellY * CellSize) - y0) / dy : 1e30f;
+
+		for (;;) {
+			if (cellX == targetX && cellY == targetY) {
+				return true;
+			}
+			if (tMaxX < tMaxY) {
+				cellX += stepX;
+				tMaxX += tDeltaX;
+			}
+			else {
+				cellY += stepY;
+				tMaxY += tDeltaY;
+			}
+			if (cellX == targetX && cellY == targetY) {
+				return true;
+			}
+			if (isOccluder(level, cellX, cellY) || cellX < 0 || cellX >= (int)LevelWidth || cellY < 0 || cellY >= (int)LevelHeight) {
+				return false;
+			}
+		}
+	}
+
+	bool isCellVisible(const int* level, int fromX, int fromY, int toX, int toY) {
+		for (int sy0 = 0; sy0 < NumSamples; ++sy0) {
+			for (int sx0 = 0; sx0 < NumSamples; ++sx0) {
+				float x0 = (fromX + Samples[sx0]) * CellSize;
+				float y0 = (fromY + Samples[sy0]) * CellSize;
+				for (int sy1 = 0; sy1 < NumSamples; ++sy1) {
+					for (int sx1 = 0; sx1 < NumSamples; ++sx1) {
+						float x1 = (toX + Samples[sx1]) * CellSize;
+						float y1 = (toY + Samples[sy1]) * CellSize;
+						if (isLineClear(level, x0, y0, x1, y1, toX, toY)) {
+							return true;
+						}
+					}
+				}
+			}
+		}
+		return false;
+	}
+
+	void buildRow(const int* level, int from, unsigned char* row) {
+		memset(row, 0, VisibilityBytes);
+		int fromX = from % LevelWidth;
+		int fromY = from / LevelWidth;
+		if (isOccluder(level, fromX, fromY)) {
+			return;
+		}
+		bool visible[NumCells];
+		for (int to = 0; to < NumCells; ++to) {
+			visible[to] = to == from || isCellVisible(level, fromX, fromY, to % LevelWidth, to / LevelWidth);
+		}
+		// The samples can miss lines that just graze past a corner, so every visible cell also makes its neighbours visible
+		for (int to = 0; to < NumCells; ++to) {
+			int toX = to % LevelWidth;
+			int toY = to / LevelWidth;
+			for (int y = toY - 1; y <= toY + 1; ++y) {
+				for (int x = toX - 1; x <= toX + 1; ++x) {
+					if (x >= 0 && x < (int)LevelWidth && y >= 0 && y < (int)LevelHeight && visible[y * LevelWidth + x]) {
+						row[to >> 3] |= 1 << (to & 7);
+					}
+				}
+			}
+		}
+	}
+
+	// Decodes the row starting at offset and checks that it stays inside of the data and decodes to exactly VisibilityBytes
+	bool decompressRow(const std::vector<unsigned char>& data, unsigned int offset, unsigned char* row) {
+		size_t in = offset;
+		for (int i = 0; i < VisibilityBytes;) {
+			if (in >= data.size()) {
+				return false;
+			}
+			if (data[in] != 0) {
+				row[i++] = data[in++];
+				continue;
+			}
+			if (in + 1 >= data.size()) {
+				return false;
+			}
+			int run = data[in + 1];
+			if (run == 0 || i + run > VisibilityBytes) {
+				return false;
+			}
+			memset(&row[i], 0, run);
+			i += run;
+			in += 2;
+		}
+		return true;
+	}
+
+	void compressRow(const unsigned char* row, std::vector<unsigned char>& out) {
+		for (int i = 0; i < VisibilityBytes; ++i) {
+			if (row[i] != 0) {
+				out.push_back(row[i]);
+				continue;
+			}
+			int run = 1;
+			while (i + run < VisibilityBytes && row[i + run] == 0 && run < 255) {
+				++run;
+			}
+			out.push_back(0);
+			out.push_back((unsigned char)run);
+			i += run - 1;
+		}
+	}
+
+	void compressRows(const std::vector<unsigned char>& rows) {
+		compressed.clear();
+		for (int row = 0; row < NumCells; ++row) {
+			offsets[row] = (unsigned int)compressed.size();
+			compressRow(&rows[row * VisibilityBytes], compressed);
+		}
+	}
+
+	// Builds the given rows on all hardware threads and returns the number of threads used
+	unsigned int buildRows(const int* level, const std::vector<int>& which, std::vector<unsigned char>& rows) {
+		// Every worker builds whole rows, so no two threads ever write the same data
+		std::atomic<int> next(0);
+		auto worker = [&]() {
+			for (int i = next++; i < (int)which.size(); i = next++) {
+				buildRow(level, which[i], &rows[which[i] * VisibilityBytes]);
+			}
+		};
+		unsigned int numThreads = std::thread::hardware_concurrency();
+		if (numThreads == 0) numThreads = 1;
+		if (numThreads > which.size()) numThreads = (unsigned int)which.size();
+		std::vector<std::thread> threads;
+		for (unsigned int i = 1; i < numThreads; ++i) {
+			threads.push_back(std::thread(worker));
+		}
+		worker();
+		for (std::thread& thread : threads) {
+			thread.join();
+		}
+		return numThreads;
+	}
+
+	void build(const int* level) {
+		std::vector<unsigned char> rows(NumCells * VisibilityBytes);
+		std::vector<int> all;
+		for (int row = 0; row < NumCells; ++row) {
+			all.push_back(row);
+		}
+		unsigned int numThreads = buildRows(level, all, rows);
+		compressRows(rows);
+		log(Info, "Built visibility sets for %i cells using %u threads, %i bytes compressed.", NumCells, numThreads, (int)compressed.size());
+	}
+
+	bool load(const char* filename, unsigned int hash) {
+		FILE* file = fopen(filename, "rb");
+		if (file == nullptr) {
+			return false;
+		}
+		unsigned int header[3];
+		bool valid = fread(header, sizeof(header), 1, file) == 1 && header[0] == CacheMagic && header[1] == hash;
+		if (valid) {
+			compressed.resize(header[2]);
+			valid = fread(offsets, sizeof(offsets), 1, file) == 1 && (header[2] == 0 || fread(compressed.data(), header[2], 1, file) == 1);
+		}
+		fclose(file);
+
+		// Don't trust the file beyond the header, every row has to decode cleanly
+		unsigned char row[VisibilityBytes];
+		for (int i = 0; valid && i < NumCells; ++i) {
+			valid = offsets[i] < header[2] && decompressRow(compressed, offsets[i], row);
+		}
+		return valid;
+	}
+
+	void save(const char* filename, unsigned int hash) {
+		FILE* file = fopen(filename, "wb");
+		if (file == nullptr) {
+			log(Warning, "Could not write visibility cache %s.", filename);
+			return;
+		}
+		unsigned int header[3] = { CacheMagic, hash, (unsigned int)compressed.size() };
+		fwrite(header, sizeof(header), 1, file);
+		fwrite(offsets, sizeof(offsets), 1, file);
+		fwrite(compressed.data(), compressed.size(), 1, file);
+		fclose(file);
+	}
+
+	void update() {
+		const int* level = levelSnapshot();
+		unsigned int hash = hashLevel(level);
+		if (load(cachePath, hash)) {
+			log(Info, "Loaded visibility sets from %s.", cachePath);
+			return;
+		}
+		build(level);
+		save(cachePath, hash);
+	}
+
+	void onLevelEdits(const LevelEdit* edits, int count) {
+		std::vector<unsigned char> rows(NumCells * VisibilityBytes);
+		for (int row = 0; row < NumCells; ++row) {
+			decompressRow(compressed, offsets[row], &rows[row * VisibilityBytes]);
+		}
+
+		// Dynamic cells never block visibility, only changes to the static walls require new sets. A line of sight can only pass
+		// through the edited cell if it reaches it first, so only the cell itself and the cells that could already see it change.
+		std::vector<bool> affected(NumCells, false);
+		for (int i = 0; i < count; ++i) {
+			const LevelEdit& edit = edits[i];
+			if (isLevelCellDynamic(edit.x, edit.y) || (edit.previous > 0) == (edit.value > 0)) {
+				continue;
+			}
+			int cell = edit.y * LevelWidth + edit.x;
+			affected[cell] = true;
+			for (int row = 0; row < NumCells; ++row) {
+				if (rows[row * VisibilityBytes + (cell >> 3)] & (1 << (cell & 7))) {
+					affected[row] = true;
+				}
+			}
+		}
+
+		std::vector<int> which;
+		for (int row = 0; row < NumCells; ++row) {
+			if (affected[row]) which.push_back(row);
+		}
+		if (which.empty()) {
+			return;
+		}
+		buildRows(levelSnapshot(), which, rows);
+		compressRows(rows);
+		log(Info, "Rebuilt visibility sets for %i of %i cells.", (int)which.size(), NumCells);
+	}
+}
+
+bool VisibleSet::test(int x, int y) const {
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return false;
+	}
+	int index = y * LevelWidth + x;
+	return (bits[index >> 3] & (1 << (index & 7))) != 0;
+}
+
+bool VisibleSet::intersects(const VisibleSet& other) const {
+	for (int i = 0; i < VisibilityBytes; ++i) {
+		if (bits[i] & other.bits[i]) {
+			return true;
+		}
+	}
+	return false;
+}
+
+void initVisibility(const char* cacheFile) {
+	cachePath = cacheFile;
+	update();
+	addLevelListener(onLevelEdits);
+}
+
+void getVisibleSet(int x, int y, VisibleSet& set) {
+	memset(set.bits, 0, VisibilityBytes);
+	if (x < 0 || x >= (int)LevelWidth || y < 0 || y >= (int)LevelHeight) {
+		return;
+	}
+	decompressRow(compressed, offsets[y * LevelWidth + x], set.bits);
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "Level.h"
+
+// Potentially visible sets (PVS). For every cell of the level, the set of cells that can be seen from anywhere inside of it.
+// The sets are conservative with respect to dynamic cells, which never block visibility.
+
+static constexpr int VisibilityBytes = (LevelWidth * LevelHeight + 7) / 8;
+
+// Decompressed visibility set of a single cell
+struct VisibleSet {
+	unsigned char bits[VisibilityBytes];
+
+	bool test(int x, int y) const;
+	bool intersects(const VisibleSet& other) const;
+};
+
+// Loads the sets from cacheFile if it matches the current level, otherwise builds them in parallel and writes the cache.
+// When a static cell of the level is edited, the sets of all cells that could see it are rebuilt right away inside of
+// commitLevelEdits. This blocks the frame for the time it takes to trace those rows, so static walls should only change rarely;
+// doors and other frequently changing cells should be marked as dynamic. Runtime edits are not written to the cache.
+void initVisibility(const char* cacheFile);
+void getVisibleSet(int x, int y, VisibleSet& set);